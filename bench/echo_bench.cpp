@@ -0,0 +1,310 @@
+// Per-message CPU cost of the echo data path, measured against the in-process loopback provider
+// (src/loopback.h) so that it runs on any Linux box, without an RDMA device.
+//
+// Every benchmark connects a client and a server connection_t through the loopback connection
+// manager, exactly like client.cpp and server.cpp do, but without the pollcq thread: the
+// benchmark drives the CQ itself.
+//
+// Each benchmark iteration is one message. Messages are timed in batches of kBatch with manual
+// timing, and the queues are refilled between batches outside of the timed region. Sends posted
+// in the timed region find no receive on the peer, so the loopback only queues them (a lock and a
+// copy of the work request, the equivalent of a provider writing a WQE and ringing the doorbell).
+// They are delivered, with their payload copy and completions, by the untimed refill. On a NIC
+// that part is done by DMA, not by the CPU.
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "echo.h"
+
+// Messages per timed batch. Must fit in the 10 WR deep queues created by
+// initialize_peer_connection.
+static const int kBatch = 8;
+
+// The send and receive completions of one batch.
+static const int kCqDepth = 2 * kBatch;
+
+typedef struct loopback_pair {
+    struct rdma_event_channel* cm_channel;
+    struct rdma_cm_id* listener;
+    struct rdma_cm_id* client;
+    struct rdma_cm_id* server;
+    connection_t* client_conn;
+    connection_t* server_conn;
+} loopback_pair_t;
+
+static int completions_seen = 0;
+
+static void on_count_completion(struct ibv_wc* wc)
+{
+    benchmark::DoNotOptimize(wc);
+    completions_seen++;
+}
+
+// The production app_context (create_app_context), minus the pollcq thread that
+// build_app_context would start: the benchmarks drive the CQ themselves.
+static void build_bench_app_context()
+{
+    if (app_context != NULL) {
+        return;
+    }
+
+    struct ibv_device** devices;
+    struct ibv_context* verbs_context;
+    int num_devices = 0;
+    FAIL_ON_Z(devices = ibv_get_device_list(&num_devices));
+    FAIL_ON_Z(num_devices);
+    FAIL_ON_Z(verbs_context = ibv_open_device(devices[0]));
+    ibv_free_device_list(devices);
+
+    create_app_context(verbs_context, kCqDepth);
+}
+
+static struct rdma_cm_id* expect_cm_event(struct rdma_event_channel* channel, enum rdma_cm_event_type type)
+{
+    struct rdma_cm_event* event = NULL;
+    FAIL_ON_NZ(rdma_get_cm_event(channel, &event));
+    FAIL_ON_NZ(event->event != type);
+    struct rdma_cm_id* id = event->id;
+    rdma_ack_cm_event(event);
+    return id;
+}
+
+// Poll the CQ empty; every completion must be successful, unless flushed is set.
+static int drain_cq(bool flushed = false)
+{
+    struct ibv_wc wc[kCqDepth];
+    int n, polled = 0;
+    while ((n = ibv_poll_cq(app_context->completionQ, kCqDepth, wc)) > 0) {
+        for (int i = 0; i < n; i++) {
+            FAIL_ON_NZ(wc[i].status != IBV_WC_SUCCESS && !(flushed && wc[i].status == IBV_WC_WR_FLUSH_ERR));
+        }
+        polled += n;
+    }
+    FAIL_ON_NZ(n < 0);
+    return polled;
+}
+
+static void expect_completions(int expected)
+{
+    FAIL_ON_NZ(drain_cq() != expected);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Walk through the same connection manager events as client.cpp and server.cpp.
+static void connect_pair(loopback_pair_t* p)
+{
+    struct sockaddr_in addr;
+
+    build_bench_app_context();
+    memset(p, 0, sizeof(*p));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    FAIL_ON_Z(p->cm_channel = rdma_create_event_channel());
+    FAIL_ON_NZ(rdma_create_id(p->cm_channel, &p->listener, NULL, RDMA_PS_IB));
+    FAIL_ON_NZ(rdma_bind_addr(p->listener, (struct sockaddr*)&addr));
+    FAIL_ON_NZ(rdma_listen(p->listener, 10));
+    addr.sin_port = rdma_get_src_port(p->listener);
+
+    FAIL_ON_NZ(rdma_create_id(p->cm_channel, &p->client, NULL, RDMA_PS_IB));
+    FAIL_ON_NZ(rdma_resolve_addr(p->client, NULL, (struct sockaddr*)&addr, 500));
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ADDR_RESOLVED);
+    initialize_peer_connection(p->client, on_count_completion);
+    FAIL_ON_NZ(rdma_resolve_route(p->client, 500));
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ROUTE_RESOLVED);
+
+    struct rdma_conn_param conn_param;
+    memset(&conn_param, 0, sizeof(conn_param));
+    FAIL_ON_NZ(rdma_connect(p->client, &conn_param));
+    p->server = expect_cm_event(p->cm_channel, RDMA_CM_EVENT_CONNECT_REQUEST);
+    initialize_peer_connection(p->server, on_count_completion);
+    FAIL_ON_NZ(rdma_accept(p->server, &conn_param));
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ESTABLISHED);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ESTABLISHED);
+
+    p->client_conn = (connection_t*)p->client->context;
+    p->server_conn = (connection_t*)p->server->context;
+    strcpy(p->client_conn->send_buf, "hello");
+}
+
+static void disconnect_pair(loopback_pair_t* p)
+{
+    FAIL_ON_NZ(rdma_disconnect(p->client));
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_DISCONNECTED);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_DISCONNECTED);
+    drain_cq(true);
+
+    destroy_peer_context(p->client);
+    destroy_peer_context(p->server);
+    rdma_destroy_id(p->listener);
+    rdma_destroy_event_channel(p->cm_channel);
+}
+
+static void BM_post_send_work_request(benchmark::State& state)
+{
+    loopback_pair_t p;
+    connect_pair(&p);
+
+    // Use up the server's initial receive, so that the timed sends are parked.
+    post_send_work_request(p.client_conn);
+    expect_completions(2);
+
+    while (state.KeepRunningBatch(kBatch)) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kBatch; i++) {
+            post_send_work_request(p.client_conn);
+        }
+        state.SetIterationTime(seconds_since(start));
+
+        for (int i = 0; i < kBatch; i++) {
+            post_recv_work_request(p.server_conn);
+        }
+        expect_completions(2 * kBatch);
+    }
+
+    disconnect_pair(&p);
+}
+BENCHMARK(BM_post_send_work_request)->UseManualTime();
+
+static void BM_post_recv_work_request(benchmark::State& state)
+{
+    loopback_pair_t p;
+    connect_pair(&p);
+
+    while (state.KeepRunningBatch(kBatch)) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kBatch; i++) {
+            post_recv_work_request(p.server_conn);
+        }
+        state.SetIterationTime(seconds_since(start));
+
+        for (int i = 0; i < kBatch; i++) {
+            post_send_work_request(p.client_conn);
+        }
+        expect_completions(2 * kBatch);
+    }
+
+    disconnect_pair(&p);
+}
+BENCHMARK(BM_post_recv_work_request)->UseManualTime();
+
+// The body of the pollcq loop: one CQ event, then the send and receive completions of a whole
+// batch of messages, as when completions pile up behind the poller thread.
+static void BM_pollcq_dispatch(benchmark::State& state)
+{
+    loopback_pair_t p;
+    connect_pair(&p);
+
+    // A previous benchmark may have left the CQ disarmed with its event still on the channel;
+    // one round trip through process_cq_event consumes it and re-arms the CQ.
+    post_send_work_request(p.client_conn);
+    post_recv_work_request(p.server_conn);
+    process_cq_event(on_count_completion);
+
+    completions_seen = 0;
+    while (state.KeepRunningBatch(kBatch)) {
+        for (int i = 0; i < kBatch; i++) {
+            post_recv_work_request(p.server_conn);
+            post_send_work_request(p.client_conn);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        process_cq_event(on_count_completion);
+        state.SetIterationTime(seconds_since(start));
+    }
+    FAIL_ON_NZ(completions_seen != 2 * (int)state.iterations());
+
+    disconnect_pair(&p);
+}
+BENCHMARK(BM_pollcq_dispatch)->UseManualTime();
+
+// Send a batch of client messages to the server and return their receive completions.
+static void send_batch_to_server(loopback_pair_t* p, struct ibv_wc* recv_wc)
+{
+    struct ibv_wc wc;
+    int polled = 0, received = 0;
+
+    for (int i = 0; i < kBatch; i++) {
+        post_send_work_request(p->client_conn);
+    }
+    while (ibv_poll_cq(app_context->completionQ, 1, &wc) > 0) {
+        FAIL_ON_NZ(wc.status != IBV_WC_SUCCESS);
+        if (wc.opcode & IBV_WC_RECV) {
+            FAIL_ON_NZ(wc.wr_id != (uintptr_t)p->server_conn);
+            recv_wc[received++] = wc;
+        }
+        polled++;
+    }
+    FAIL_ON_NZ(received != kBatch || polled != 2 * kBatch);
+}
+
+// One message = the server handling its receive completion (copy, echo back) and the completion
+// of that echo (re-post the receive), i.e. what on_echo_completion does per client message.
+static void BM_echo_handler(benchmark::State& state)
+{
+    loopback_pair_t p;
+    connect_pair(&p);
+
+    struct ibv_wc recv_wc[kBatch];
+    struct ibv_wc send_wc;
+    memset(&send_wc, 0, sizeof(send_wc));
+    send_wc.wr_id = (uintptr_t)p.server_conn;
+    send_wc.status = IBV_WC_SUCCESS;
+    send_wc.opcode = IBV_WC_SEND;
+    send_wc.qp_num = p.server_conn->qp->qp_num;
+
+    // Use up the initial receive on both sides, so that the echoes sent by the timed handler are
+    // parked, then give the server a batch of messages to echo.
+    post_send_work_request(p.client_conn);
+    post_send_work_request(p.server_conn);
+    expect_completions(4);
+    for (int i = 0; i < kBatch; i++) {
+        post_recv_work_request(p.server_conn);
+    }
+    send_batch_to_server(&p, recv_wc);
+
+    while (state.KeepRunningBatch(kBatch)) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kBatch; i++) {
+            on_echo_completion(&recv_wc[i]);
+            on_echo_completion(&send_wc);
+        }
+        state.SetIterationTime(seconds_since(start));
+
+        // Deliver the echoes, the handler has re-posted the server's receives for the next batch.
+        for (int i = 0; i < kBatch; i++) {
+            post_recv_work_request(p.client_conn);
+        }
+        expect_completions(2 * kBatch);
+        send_batch_to_server(&p, recv_wc);
+    }
+
+    disconnect_pair(&p);
+}
+BENCHMARK(BM_echo_handler)->UseManualTime();
+
+int main(int argc, char** argv)
+{
+    // pollcq and on_echo_completion log every work completion. Keep that cost in the measurement,
+    // but throw the output away so that stdout only carries the benchmark report.
+    FAIL_ON_Z(echo_log = fopen("/dev/null", "w"));
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
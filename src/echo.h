@@ -4,14 +4,19 @@
 #include <iostream>
 
 #include <arpa/inet.h>
+#ifdef ECHO_LOOPBACK
+#include "loopback.h"
+#else
 #include <infiniband/verbs.h>
-#include <pthread.h>
 #include <rdma/rdma_verbs.h>
+#endif
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 
 #define BUFFER_SIZE 1024
+#define CQ_SIZE 10
 
 #define FAIL_ON_NZ(x)                                                          \
     do {                                                                    \
@@ -49,40 +54,44 @@ typedef void (*on_complete_t)(struct ibv_wc*);
 
 app_context_t* app_context = NULL;
 
-static void* pollcq(void* poncomplete)
+// Where the data path (process_cq_event, on_echo_completion) logs every work completion.
+static FILE* echo_log = stdout;
+
+// Wait for one event on the completion channel and dispatch every work completion on the CQ.
+static void process_cq_event(on_complete_t on_complete)
 {
   struct ibv_cq* cq;
   //Yuanguo: work-completion，即Complete Queue上的通知。
   struct ibv_wc wc;
   void* ctx = NULL;
+
+  // Yuanguo: 当有一个通知(work completion)被放到completion queue (cq)时，channel上就会有一个event；
+  // 当前线程:
+  //     - 从channel get event (ibv_get_cq_event)，若get到一个event，就代表有一个通知(work completion)在cq上；
+  //     - 所以就poll completionQ (ibv_poll_cq)去获取通知(work completion)，即wc结构体；
+  // 注意：还会ibv_req_notify_cq去请求接收下一个通知(work completion)；
+  FAIL_ON_NZ(ibv_get_cq_event(app_context->channel, &cq, &ctx));
+  ibv_ack_cq_events(cq, 0);
+  FAIL_ON_NZ(ibv_req_notify_cq(cq, 0));
+  while (ibv_poll_cq(cq, 1, &wc)) {
+    fprintf(echo_log, "got work-completion: opcode=%d\n", wc.opcode);
+    on_complete(&wc);
+  }
+}
+
+static void* pollcq(void* poncomplete)
+{
   on_complete_t on_complete = (on_complete_t)poncomplete;
 
   while (1) {
-    // Yuanguo: 当有一个通知(work completion)被放到completion queue (cq)时，channel上就会有一个event；
-    // 当前线程:
-    //     - 从channel get event (ibv_get_cq_event)，若get到一个event，就代表有一个通知(work completion)在cq上；
-    //     - 所以就poll completionQ (ibv_poll_cq)去获取通知(work completion)，即wc结构体；
-    // 注意：还会ibv_req_notify_cq去请求接收下一个通知(work completion)；
-    FAIL_ON_NZ(ibv_get_cq_event(app_context->channel, &cq, &ctx));
-    ibv_ack_cq_events(cq, 0);
-    FAIL_ON_NZ(ibv_req_notify_cq(cq, 0));
-    while (ibv_poll_cq(cq, 1, &wc)) {
-      std::cout << "got work-completion: opcode=" << wc.opcode << std::endl;
-      on_complete(&wc);
-    }
+    process_cq_event(on_complete);
   }
 }
 
-static void build_app_context(struct ibv_context* verbs_context, on_complete_t on_complete)
+// Allocate app_context and its PD, completion channel and CQ (cq_size entries), with CQ notifications
+// requested; the poller thread is started by build_app_context.
+static void create_app_context(struct ibv_context* verbs_context, int cq_size)
 {
-    if (app_context != NULL) {
-        if (app_context->verbs != verbs_context) {
-            printf("Multiple Contexts?! Different Devices?!\n");
-            exit(EXIT_FAILURE);
-        }
-        return;
-    }
-
     //Yuanguo: The memory is set to zero by calloc;
     app_context = (app_context_t*)calloc(1, sizeof(app_context_t));
 
@@ -104,13 +113,26 @@ static void build_app_context(struct ibv_context* verbs_context, on_complete_t o
     FAIL_ON_Z(app_context->channel = ibv_create_comp_channel(verbs_context));
 
     // Create Completion Queue
-    FAIL_ON_Z(app_context->completionQ = ibv_create_cq(verbs_context, 10, NULL, app_context->channel, 0));
+    FAIL_ON_Z(app_context->completionQ = ibv_create_cq(verbs_context, cq_size, NULL, app_context->channel, 0));
 
     // Start receiving Completion Queue notifications
     // Yuanguo: 前面设置了completionQ相关的channel；
     //   现在请求接收completionQ上的通知(通知就是work completion)；
     //   当有一个通知(work completion)被放到completionQ时，就会有一个event被放到channel;
     FAIL_ON_NZ(ibv_req_notify_cq(app_context->completionQ, 0));
+}
+
+static void build_app_context(struct ibv_context* verbs_context, on_complete_t on_complete)
+{
+    if (app_context != NULL) {
+        if (app_context->verbs != verbs_context) {
+            printf("Multiple Contexts?! Different Devices?!\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    create_app_context(verbs_context, CQ_SIZE);
 
     // Yuanguo: 上面说，当有一个通知(work completion)被放到completionQ时，channel上就会有一个event；
     //   现在起一个线程，从channel get event (ibv_get_cq_event)，若get到一个event，就代
@@ -166,6 +188,35 @@ static void post_recv_work_request(connection_t* conn)
   FAIL_ON_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
+//Yuanguo: server端的echo逻辑，处理Work Completion通知。有两种类型：
+//  - IBV_WC_RECV：Receive Work Completion，即接收完成通知
+//      - 把接收到的数据打印出来；
+//      - 把接收到的数据拷贝到send_buf;
+//      - 发送(即post一个Send Work Request)
+//  - IBV_WC_SEND：Send Work Completion，即发送完成通知
+//      - 把已发送的数据打印出来；
+//      - 继续接收(即post一个Receive Work Request)，client可能继续发消息！
+static void on_echo_completion(struct ibv_wc* wc)
+{
+  if (wc->status != IBV_WC_SUCCESS) {
+    fprintf(echo_log, "Completion failed!");
+    return;
+  }
+
+  connection_t* conn = (connection_t*)(uintptr_t)wc->wr_id;
+  if (wc->opcode & IBV_WC_RECV) {
+    fprintf(echo_log, "[%lu] Received: %s\n", wc->wr_id, conn->recv_buf);
+    memcpy(conn->send_buf, conn->recv_buf, BUFFER_SIZE);
+    memset(conn->recv_buf, 0, BUFFER_SIZE);
+    post_send_work_request(conn);
+  } else if (wc->opcode == IBV_WC_SEND) {
+    fprintf(echo_log, "[%lu] Sent: %s.\n", wc->wr_id, conn->send_buf);
+    memset(conn->send_buf, 0, BUFFER_SIZE);
+    memset(conn->recv_buf, 0, BUFFER_SIZE);
+    post_recv_work_request(conn);
+  }
+}
+
 static void initialize_peer_connection(struct rdma_cm_id* id, on_complete_t on_complete)
 {
     //Yuanguo: struct rdma_cm_id结构体代表通信端点（endpoint）。它封装了建立和管理RDMA连接所需的所有信息。它提供了一种简化的方法来
@@ -0,0 +1,759 @@
+#include "loopback.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+typedef struct loopback_cq : ibv_cq {
+    std::deque<struct ibv_wc> entries;
+    bool armed;
+} loopback_cq_t;
+
+typedef struct loopback_comp_channel : ibv_comp_channel {
+    std::deque<struct ibv_cq*> events;
+    std::condition_variable cond;
+} loopback_comp_channel_t;
+
+typedef struct loopback_wqe {
+    uint64_t wr_id;
+    bool signaled;
+    int num_sge;
+    struct ibv_sge sg_list[LOOPBACK_MAX_SGE];
+} loopback_wqe_t;
+
+typedef struct loopback_qp : ibv_qp {
+    struct ibv_qp_cap cap;
+    int sq_sig_all;
+    struct loopback_qp* peer;
+    std::deque<loopback_wqe_t> sq; // sends waiting for a receive on the peer
+    std::deque<loopback_wqe_t> rq; // posted receives
+} loopback_qp_t;
+
+typedef struct loopback_mr_entry {
+    struct ibv_mr* mr;
+    int access;
+} loopback_mr_entry_t;
+
+typedef struct loopback_event_channel : rdma_event_channel {
+    std::deque<struct rdma_cm_event> events;
+    std::condition_variable cond;
+} loopback_event_channel_t;
+
+typedef struct loopback_cm_id : rdma_cm_id {
+    struct loopback_cm_id* peer;
+    bool listening;
+    bool connected;
+} loopback_cm_id_t;
+
+// The one and only loopback device. A single lock protects every queue of every object; the
+// completion and event channels wait on it with their own condition variables.
+typedef struct loopback_device {
+    std::mutex lock;
+    struct ibv_device device;
+    struct ibv_context context;
+    uint32_t next_handle;
+    uint32_t next_key;
+    uint32_t next_qp_num;
+    uint16_t next_port;
+    std::unordered_map<uint32_t, loopback_mr_entry_t> mrs;        // lkey -> mr
+    std::unordered_map<uint16_t, loopback_cm_id_t*> listeners;   // port (host order) -> listening id
+
+    loopback_device() : next_handle(1), next_key(0x1000), next_qp_num(0x100), next_port(49152)
+    {
+        memset(&device, 0, sizeof(device));
+        device.node_type = IBV_NODE_CA;
+        device.transport_type = IBV_TRANSPORT_IB;
+        snprintf(device.name, sizeof(device.name), "%s", LOOPBACK_DEVICE_NAME);
+        snprintf(device.dev_name, sizeof(device.dev_name), "uverbs_lo");
+        snprintf(device.dev_path, sizeof(device.dev_path), "(loopback)");
+        snprintf(device.ibdev_path, sizeof(device.ibdev_path), "(loopback)");
+
+        memset(&context, 0, sizeof(context));
+        context.device = &device;
+        context.cmd_fd = -1;
+        context.async_fd = -1;
+        context.num_comp_vectors = 1;
+    }
+} loopback_device_t;
+
+static loopback_device_t lo;
+
+static int fail_errno(int err)
+{
+    errno = err;
+    return -1;
+}
+
+// ---------------------------------------------------------------- completions
+
+// Caller holds lo.lock.
+static void push_wc(struct ibv_cq* ibcq, const struct ibv_wc& wc)
+{
+    loopback_cq_t* cq = static_cast<loopback_cq_t*>(ibcq);
+
+    // A real HCA raises IBV_EVENT_CQ_ERR and the QPs go to error; there is no way to recover
+    // from it here either, and it always means the caller sized the CQ wrong.
+    if ((int)cq->entries.size() >= cq->cqe) {
+        fprintf(stderr, "loopback: completion queue %u overrun (cqe=%d).\n", cq->handle, cq->cqe);
+        abort();
+    }
+    cq->entries.push_back(wc);
+
+    if (cq->armed && cq->channel != NULL) {
+        loopback_comp_channel_t* channel = static_cast<loopback_comp_channel_t*>(cq->channel);
+        cq->armed = false;
+        channel->events.push_back(cq);
+        channel->cond.notify_one();
+    }
+}
+
+static void complete(loopback_qp_t* qp, const loopback_wqe_t& wqe, bool recv, enum ibv_wc_status status,
+                     uint32_t byte_len)
+{
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = wqe.wr_id;
+    wc.status = status;
+    wc.opcode = recv ? IBV_WC_RECV : IBV_WC_SEND;
+    wc.byte_len = byte_len;
+    wc.qp_num = qp->qp_num;
+    wc.src_qp = qp->peer ? qp->peer->qp_num : 0;
+    push_wc(recv ? qp->recv_cq : qp->send_cq, wc);
+}
+
+// Caller holds lo.lock. Returns the total length of the sges, or -1 if one of them is not covered
+// by a memory region of the given protection domain with the required access.
+static int64_t check_sges(const loopback_wqe_t& wqe, struct ibv_pd* pd, int access)
+{
+    int64_t total = 0;
+    for (int i = 0; i < wqe.num_sge; i++) {
+        const struct ibv_sge& sge = wqe.sg_list[i];
+        auto it = lo.mrs.find(sge.lkey);
+        if (it == lo.mrs.end()) {
+            return -1;
+        }
+        struct ibv_mr* mr = it->second.mr;
+        uintptr_t begin = (uintptr_t)mr->addr;
+        if (mr->pd != pd || sge.addr < begin || sge.addr + sge.length > begin + mr->length) {
+            return -1;
+        }
+        if ((it->second.access & access) != access) {
+            return -1;
+        }
+        total += sge.length;
+    }
+    return total;
+}
+
+static void copy_sges(const loopback_wqe_t& dst, const loopback_wqe_t& src)
+{
+    int di = 0;
+    uint32_t doff = 0;
+    for (int si = 0; si < src.num_sge; si++) {
+        const char* from = (const char*)(uintptr_t)src.sg_list[si].addr;
+        uint32_t left = src.sg_list[si].length;
+        while (left > 0) {
+            const struct ibv_sge& to = dst.sg_list[di];
+            uint32_t n = to.length - doff < left ? to.length - doff : left;
+            memcpy((char*)(uintptr_t)to.addr + doff, from, n);
+            from += n;
+            left -= n;
+            doff += n;
+            if (doff == to.length) {
+                di++;
+                doff = 0;
+            }
+        }
+    }
+}
+
+// Caller holds lo.lock. Match the pending sends of qp with the receives posted on its peer.
+static void deliver(loopback_qp_t* qp)
+{
+    loopback_qp_t* peer = qp->peer;
+    if (peer == NULL) {
+        return;
+    }
+
+    while (!qp->sq.empty() && !peer->rq.empty()) {
+        loopback_wqe_t send = qp->sq.front();
+        qp->sq.pop_front();
+
+        int64_t len = check_sges(send, qp->pd, 0);
+        if (len < 0) {
+            complete(qp, send, false, IBV_WC_LOC_PROT_ERR, 0);
+            continue;
+        }
+
+        loopback_wqe_t recv = peer->rq.front();
+        peer->rq.pop_front();
+
+        int64_t room = check_sges(recv, peer->pd, IBV_ACCESS_LOCAL_WRITE);
+        if (room < 0) {
+            complete(peer, recv, true, IBV_WC_LOC_PROT_ERR, 0);
+            complete(qp, send, false, IBV_WC_REM_OP_ERR, 0);
+            continue;
+        }
+        if (len > room) {
+            complete(peer, recv, true, IBV_WC_LOC_LEN_ERR, 0);
+            complete(qp, send, false, IBV_WC_REM_INV_REQ_ERR, 0);
+            continue;
+        }
+
+        copy_sges(recv, send);
+        complete(peer, recv, true, IBV_WC_SUCCESS, (uint32_t)len);
+        if (send.signaled || qp->sq_sig_all) {
+            complete(qp, send, false, IBV_WC_SUCCESS, (uint32_t)len);
+        }
+    }
+}
+
+// Caller holds lo.lock. Move qp to the error state, flushing everything outstanding on it.
+static void flush(loopback_qp_t* qp)
+{
+    qp->state = IBV_QPS_ERR;
+    if (qp->peer != NULL) {
+        qp->peer->peer = NULL;
+        qp->peer = NULL;
+    }
+    for (const loopback_wqe_t& wqe : qp->rq) {
+        complete(qp, wqe, true, IBV_WC_WR_FLUSH_ERR, 0);
+    }
+    for (const loopback_wqe_t& wqe : qp->sq) {
+        complete(qp, wqe, false, IBV_WC_WR_FLUSH_ERR, 0);
+    }
+    qp->rq.clear();
+    qp->sq.clear();
+}
+
+// ---------------------------------------------------------------- verbs
+
+struct ibv_device** ibv_get_device_list(int* num_devices)
+{
+    struct ibv_device** list = (struct ibv_device**)calloc(2, sizeof(struct ibv_device*));
+    if (list == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    list[0] = &lo.device;
+    if (num_devices != NULL) {
+        *num_devices = 1;
+    }
+    return list;
+}
+
+void ibv_free_device_list(struct ibv_device** list)
+{
+    free(list);
+}
+
+struct ibv_context* ibv_open_device(struct ibv_device* device)
+{
+    if (device != &lo.device) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &lo.context;
+}
+
+int ibv_close_device(struct ibv_context* context)
+{
+    return context == &lo.context ? 0 : EINVAL;
+}
+
+struct ibv_pd* ibv_alloc_pd(struct ibv_context* context)
+{
+    if (context != &lo.context) {
+        errno = EINVAL;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    struct ibv_pd* pd = new ibv_pd();
+    pd->context = context;
+    pd->handle = lo.next_handle++;
+    return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd* pd)
+{
+    delete pd;
+    return 0;
+}
+
+struct ibv_mr* ibv_reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access)
+{
+    if (pd == NULL || (addr == NULL && length != 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    struct ibv_mr* mr = new ibv_mr();
+    mr->context = pd->context;
+    mr->pd = pd;
+    mr->addr = addr;
+    mr->length = length;
+    mr->handle = lo.next_handle++;
+    mr->lkey = mr->rkey = lo.next_key++;
+    lo.mrs[mr->lkey] = loopback_mr_entry_t{mr, access};
+    return mr;
+}
+
+int ibv_dereg_mr(struct ibv_mr* mr)
+{
+    std::lock_guard<std::mutex> guard(lo.lock);
+    lo.mrs.erase(mr->lkey);
+    delete mr;
+    return 0;
+}
+
+struct ibv_comp_channel* ibv_create_comp_channel(struct ibv_context* context)
+{
+    if (context != &lo.context) {
+        errno = EINVAL;
+        return NULL;
+    }
+    loopback_comp_channel_t* channel = new loopback_comp_channel_t();
+    channel->context = context;
+    channel->fd = -1;
+    return channel;
+}
+
+int ibv_destroy_comp_channel(struct ibv_comp_channel* channel)
+{
+    delete static_cast<loopback_comp_channel_t*>(channel);
+    return 0;
+}
+
+struct ibv_cq* ibv_create_cq(struct ibv_context* context, int cqe, void* cq_context,
+                             struct ibv_comp_channel* channel, int comp_vector)
+{
+    if (context != &lo.context || cqe <= 0 || comp_vector != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    loopback_cq_t* cq = new loopback_cq_t();
+    cq->context = context;
+    cq->channel = channel;
+    cq->cq_context = cq_context;
+    cq->handle = lo.next_handle++;
+    cq->cqe = cqe;
+    cq->armed = false;
+    return cq;
+}
+
+int ibv_destroy_cq(struct ibv_cq* ibcq)
+{
+    loopback_cq_t* cq = static_cast<loopback_cq_t*>(ibcq);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (cq->channel != NULL) {
+        std::deque<struct ibv_cq*>& events = static_cast<loopback_comp_channel_t*>(cq->channel)->events;
+        for (auto it = events.begin(); it != events.end();) {
+            it = *it == cq ? events.erase(it) : it + 1;
+        }
+    }
+    delete cq;
+    return 0;
+}
+
+int ibv_get_cq_event(struct ibv_comp_channel* ibchannel, struct ibv_cq** cq, void** cq_context)
+{
+    loopback_comp_channel_t* channel = static_cast<loopback_comp_channel_t*>(ibchannel);
+    std::unique_lock<std::mutex> guard(lo.lock);
+    channel->cond.wait(guard, [channel] { return !channel->events.empty(); });
+    *cq = channel->events.front();
+    channel->events.pop_front();
+    *cq_context = (*cq)->cq_context;
+    return 0;
+}
+
+void ibv_ack_cq_events(struct ibv_cq* cq, unsigned int nevents)
+{
+    std::lock_guard<std::mutex> guard(lo.lock);
+    cq->comp_events_completed += nevents;
+}
+
+int ibv_req_notify_cq(struct ibv_cq* cq, int solicited_only)
+{
+    (void)solicited_only;
+    std::lock_guard<std::mutex> guard(lo.lock);
+    static_cast<loopback_cq_t*>(cq)->armed = true;
+    return 0;
+}
+
+int ibv_poll_cq(struct ibv_cq* ibcq, int num_entries, struct ibv_wc* wc)
+{
+    loopback_cq_t* cq = static_cast<loopback_cq_t*>(ibcq);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    int n = 0;
+    while (n < num_entries && !cq->entries.empty()) {
+        wc[n++] = cq->entries.front();
+        cq->entries.pop_front();
+    }
+    return n;
+}
+
+struct ibv_qp* ibv_create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* attr)
+{
+    if (pd == NULL || attr->qp_type != IBV_QPT_RC || attr->send_cq == NULL || attr->recv_cq == NULL ||
+        attr->srq != NULL || attr->cap.max_send_sge > LOOPBACK_MAX_SGE ||
+        attr->cap.max_recv_sge > LOOPBACK_MAX_SGE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    loopback_qp_t* qp = new loopback_qp_t();
+    qp->context = pd->context;
+    qp->qp_context = attr->qp_context;
+    qp->pd = pd;
+    qp->send_cq = attr->send_cq;
+    qp->recv_cq = attr->recv_cq;
+    qp->handle = lo.next_handle++;
+    qp->qp_num = lo.next_qp_num++;
+    qp->state = IBV_QPS_RESET;
+    qp->qp_type = attr->qp_type;
+    qp->cap = attr->cap;
+    qp->sq_sig_all = attr->sq_sig_all;
+    qp->peer = NULL;
+    return qp;
+}
+
+int ibv_destroy_qp(struct ibv_qp* ibqp)
+{
+    loopback_qp_t* qp = static_cast<loopback_qp_t*>(ibqp);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (qp->peer != NULL) {
+        qp->peer->peer = NULL;
+    }
+    delete qp;
+    return 0;
+}
+
+int ibv_post_send(struct ibv_qp* ibqp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr)
+{
+    loopback_qp_t* qp = static_cast<loopback_qp_t*>(ibqp);
+    std::lock_guard<std::mutex> guard(lo.lock);
+
+    int rc = 0;
+    for (; wr != NULL; wr = wr->next) {
+        if (qp->state != IBV_QPS_RTS || wr->opcode != IBV_WR_SEND || wr->num_sge < 0 ||
+            (uint32_t)wr->num_sge > qp->cap.max_send_sge) {
+            rc = EINVAL;
+            break;
+        }
+        if (qp->sq.size() >= qp->cap.max_send_wr) {
+            rc = ENOMEM;
+            break;
+        }
+        loopback_wqe_t wqe;
+        wqe.wr_id = wr->wr_id;
+        wqe.signaled = (wr->send_flags & IBV_SEND_SIGNALED) != 0;
+        wqe.num_sge = wr->num_sge;
+        memcpy(wqe.sg_list, wr->sg_list, wr->num_sge * sizeof(struct ibv_sge));
+        qp->sq.push_back(wqe);
+    }
+    if (rc != 0) {
+        *bad_wr = wr;
+    }
+
+    deliver(qp);
+    return rc;
+}
+
+int ibv_post_recv(struct ibv_qp* ibqp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr)
+{
+    loopback_qp_t* qp = static_cast<loopback_qp_t*>(ibqp);
+    std::lock_guard<std::mutex> guard(lo.lock);
+
+    int rc = 0;
+    for (; wr != NULL; wr = wr->next) {
+        if (qp->state == IBV_QPS_RESET || wr->num_sge < 0 || (uint32_t)wr->num_sge > qp->cap.max_recv_sge) {
+            rc = EINVAL;
+            break;
+        }
+        if (qp->rq.size() >= qp->cap.max_recv_wr) {
+            rc = ENOMEM;
+            break;
+        }
+        loopback_wqe_t wqe;
+        wqe.wr_id = wr->wr_id;
+        wqe.signaled = true;
+        wqe.num_sge = wr->num_sge;
+        memcpy(wqe.sg_list, wr->sg_list, wr->num_sge * sizeof(struct ibv_sge));
+        if (qp->state == IBV_QPS_ERR) {
+            complete(qp, wqe, true, IBV_WC_WR_FLUSH_ERR, 0);
+        } else {
+            qp->rq.push_back(wqe);
+        }
+    }
+    if (rc != 0) {
+        *bad_wr = wr;
+    }
+
+    if (qp->peer != NULL) {
+        deliver(qp->peer);
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------- rdmacm
+
+// Caller holds lo.lock.
+static void push_cm_event(loopback_cm_id_t* id, enum rdma_cm_event_type type, loopback_cm_id_t* listen_id = NULL,
+                          int status = 0)
+{
+    loopback_event_channel_t* channel = static_cast<loopback_event_channel_t*>(id->channel);
+    struct rdma_cm_event event;
+    memset(&event, 0, sizeof(event));
+    event.id = id;
+    event.listen_id = listen_id;
+    event.event = type;
+    event.status = status;
+    channel->events.push_back(event);
+    channel->cond.notify_one();
+}
+
+// Caller holds lo.lock.
+static void set_inet_addr(struct sockaddr_in* dst, const struct sockaddr* src)
+{
+    if (src != NULL) {
+        memcpy(dst, src, sizeof(struct sockaddr_in));
+    } else {
+        memset(dst, 0, sizeof(struct sockaddr_in));
+        dst->sin_family = AF_INET;
+        dst->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    if (dst->sin_port == 0) {
+        dst->sin_port = htons(lo.next_port++);
+    }
+}
+
+// Caller holds lo.lock. Tear down the connection of id, the peer gets RDMA_CM_EVENT_DISCONNECTED.
+static void break_connection(loopback_cm_id_t* id)
+{
+    loopback_cm_id_t* peer = id->peer;
+    id->peer = NULL;
+    id->connected = false;
+    if (id->qp != NULL) {
+        flush(static_cast<loopback_qp_t*>(id->qp));
+    }
+    if (peer != NULL) {
+        bool was_connected = peer->connected;
+        peer->peer = NULL;
+        peer->connected = false;
+        if (peer->qp != NULL) {
+            flush(static_cast<loopback_qp_t*>(peer->qp));
+        }
+        if (was_connected) {
+            push_cm_event(peer, RDMA_CM_EVENT_DISCONNECTED);
+        }
+    }
+}
+
+struct rdma_event_channel* rdma_create_event_channel(void)
+{
+    loopback_event_channel_t* channel = new loopback_event_channel_t();
+    channel->fd = -1;
+    return channel;
+}
+
+void rdma_destroy_event_channel(struct rdma_event_channel* channel)
+{
+    delete static_cast<loopback_event_channel_t*>(channel);
+}
+
+int rdma_get_cm_event(struct rdma_event_channel* ibchannel, struct rdma_cm_event** event)
+{
+    loopback_event_channel_t* channel = static_cast<loopback_event_channel_t*>(ibchannel);
+    std::unique_lock<std::mutex> guard(lo.lock);
+    channel->cond.wait(guard, [channel] { return !channel->events.empty(); });
+    *event = new rdma_cm_event(channel->events.front());
+    channel->events.pop_front();
+    return 0;
+}
+
+int rdma_ack_cm_event(struct rdma_cm_event* event)
+{
+    delete event;
+    return 0;
+}
+
+int rdma_create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context,
+                   enum rdma_port_space ps)
+{
+    if (channel == NULL) {
+        return fail_errno(EINVAL);
+    }
+    loopback_cm_id_t* cm_id = new loopback_cm_id_t();
+    cm_id->channel = channel;
+    cm_id->context = context;
+    cm_id->ps = ps;
+    cm_id->port_num = 1;
+    *id = cm_id;
+    return 0;
+}
+
+int rdma_destroy_id(struct rdma_cm_id* ibid)
+{
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (id->listening) {
+        lo.listeners.erase(ntohs(id->route.addr.src_sin.sin_port));
+    }
+    break_connection(id);
+    delete id;
+    return 0;
+}
+
+int rdma_bind_addr(struct rdma_cm_id* id, struct sockaddr* addr)
+{
+    if (addr == NULL || addr->sa_family != AF_INET) {
+        return fail_errno(EAFNOSUPPORT);
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    uint16_t port = ntohs(((struct sockaddr_in*)addr)->sin_port);
+    if (port != 0 && lo.listeners.count(port)) {
+        return fail_errno(EADDRINUSE);
+    }
+    set_inet_addr(&id->route.addr.src_sin, addr);
+    id->verbs = &lo.context;
+    return 0;
+}
+
+int rdma_listen(struct rdma_cm_id* ibid, int backlog)
+{
+    (void)backlog;
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    uint16_t port = ntohs(id->route.addr.src_sin.sin_port);
+    if (port == 0) {
+        return fail_errno(EINVAL);
+    }
+    if (!lo.listeners.emplace(port, id).second) {
+        return fail_errno(EADDRINUSE);
+    }
+    id->listening = true;
+    return 0;
+}
+
+int rdma_resolve_addr(struct rdma_cm_id* ibid, struct sockaddr* src_addr, struct sockaddr* dst_addr,
+                      int timeout_ms)
+{
+    (void)timeout_ms;
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    if (dst_addr == NULL || dst_addr->sa_family != AF_INET ||
+        (src_addr != NULL && src_addr->sa_family != AF_INET)) {
+        return fail_errno(EAFNOSUPPORT);
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    set_inet_addr(&id->route.addr.src_sin, src_addr);
+    memcpy(&id->route.addr.dst_sin, dst_addr, sizeof(struct sockaddr_in));
+    id->verbs = &lo.context;
+    push_cm_event(id, RDMA_CM_EVENT_ADDR_RESOLVED);
+    return 0;
+}
+
+int rdma_resolve_route(struct rdma_cm_id* ibid, int timeout_ms)
+{
+    (void)timeout_ms;
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (id->verbs == NULL) {
+        return fail_errno(EINVAL);
+    }
+    push_cm_event(id, RDMA_CM_EVENT_ROUTE_RESOLVED);
+    return 0;
+}
+
+int rdma_connect(struct rdma_cm_id* ibid, struct rdma_conn_param* conn_param)
+{
+    (void)conn_param;
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (id->qp == NULL || id->peer != NULL) {
+        return fail_errno(EINVAL);
+    }
+
+    auto it = lo.listeners.find(ntohs(id->route.addr.dst_sin.sin_port));
+    if (it == lo.listeners.end()) {
+        push_cm_event(id, RDMA_CM_EVENT_REJECTED, NULL, ECONNREFUSED);
+        return 0;
+    }
+    loopback_cm_id_t* listener = it->second;
+
+    // Like a real CONNECT_REQUEST, the server side gets a brand new id bound to the device.
+    loopback_cm_id_t* child = new loopback_cm_id_t();
+    child->verbs = &lo.context;
+    child->channel = listener->channel;
+    child->context = listener->context;
+    child->ps = listener->ps;
+    child->port_num = listener->port_num;
+    child->route.addr.src_sin = id->route.addr.dst_sin;
+    child->route.addr.dst_sin = id->route.addr.src_sin;
+    child->peer = id;
+    id->peer = child;
+
+    push_cm_event(child, RDMA_CM_EVENT_CONNECT_REQUEST, listener);
+    return 0;
+}
+
+int rdma_accept(struct rdma_cm_id* ibid, struct rdma_conn_param* conn_param)
+{
+    (void)conn_param;
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    loopback_cm_id_t* peer = id->peer;
+    if (peer == NULL || id->connected || id->qp == NULL || peer->qp == NULL) {
+        return fail_errno(EINVAL);
+    }
+
+    loopback_qp_t* qp = static_cast<loopback_qp_t*>(id->qp);
+    loopback_qp_t* peer_qp = static_cast<loopback_qp_t*>(peer->qp);
+    qp->peer = peer_qp;
+    peer_qp->peer = qp;
+    qp->state = peer_qp->state = IBV_QPS_RTS;
+    id->connected = peer->connected = true;
+
+    push_cm_event(peer, RDMA_CM_EVENT_ESTABLISHED);
+    push_cm_event(id, RDMA_CM_EVENT_ESTABLISHED);
+    return 0;
+}
+
+int rdma_disconnect(struct rdma_cm_id* ibid)
+{
+    loopback_cm_id_t* id = static_cast<loopback_cm_id_t*>(ibid);
+    std::lock_guard<std::mutex> guard(lo.lock);
+    if (!id->connected) {
+        return fail_errno(EINVAL);
+    }
+    break_connection(id);
+    push_cm_event(id, RDMA_CM_EVENT_DISCONNECTED);
+    return 0;
+}
+
+int rdma_create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr)
+{
+    if (id->verbs == NULL || pd == NULL || pd->context != id->verbs || id->qp != NULL) {
+        return fail_errno(EINVAL);
+    }
+    struct ibv_qp* qp = ibv_create_qp(pd, qp_init_attr);
+    if (qp == NULL) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lo.lock);
+    qp->state = IBV_QPS_INIT;
+    id->qp = qp;
+    id->pd = pd;
+    return 0;
+}
+
+void rdma_destroy_qp(struct rdma_cm_id* id)
+{
+    ibv_destroy_qp(id->qp);
+    id->qp = NULL;
+}
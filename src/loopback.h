@@ -0,0 +1,398 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+// In-process loopback provider for the small verbs/rdmacm surface used by echo.h.
+//
+// The types and functions below mirror the names, field names and return conventions of
+// <infiniband/verbs.h> and <rdma/rdma_verbs.h>, so echo.h compiles unchanged when ECHO_LOOPBACK
+// is defined and nothing links against libibverbs/librdmacm. There is exactly one device; every
+// QP, CQ and cm id lives in this process:
+//   - ibv_post_send copies the payload straight into the buffer of the receive posted on the peer
+//     QP (or parks the send until one is posted) and pushes work completions onto the CQs;
+//   - CQs and completion channels are plain memory queues; an armed CQ puts one event on its
+//     channel when the next work completion arrives, like the hardware does;
+//   - rdma_connect finds the listener by port and the connection manager events
+//     (ADDR_RESOLVED, ROUTE_RESOLVED, CONNECT_REQUEST, ESTABLISHED, DISCONNECTED) are queued on
+//     the rdma_event_channels of both sides.
+// Only SEND/RECV on RC QPs is supported, which is all echo uses.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define LOOPBACK_DEVICE_NAME "rdma_lo"
+#define LOOPBACK_MAX_SGE 4
+
+// ---------------------------------------------------------------- verbs
+
+enum ibv_node_type {
+    IBV_NODE_UNKNOWN = -1,
+    IBV_NODE_CA = 1,
+};
+
+enum ibv_transport_type {
+    IBV_TRANSPORT_UNKNOWN = -1,
+    IBV_TRANSPORT_IB = 0,
+};
+
+struct ibv_device {
+    enum ibv_node_type node_type;
+    enum ibv_transport_type transport_type;
+    char name[64];
+    char dev_name[64];
+    char dev_path[256];
+    char ibdev_path[256];
+};
+
+struct ibv_context {
+    struct ibv_device* device;
+    int cmd_fd;
+    int async_fd;
+    int num_comp_vectors;
+};
+
+struct ibv_pd {
+    struct ibv_context* context;
+    uint32_t handle;
+};
+
+enum ibv_access_flags {
+    IBV_ACCESS_LOCAL_WRITE = 1,
+    IBV_ACCESS_REMOTE_WRITE = (1 << 1),
+    IBV_ACCESS_REMOTE_READ = (1 << 2),
+    IBV_ACCESS_REMOTE_ATOMIC = (1 << 3),
+};
+
+struct ibv_mr {
+    struct ibv_context* context;
+    struct ibv_pd* pd;
+    void* addr;
+    size_t length;
+    uint32_t handle;
+    uint32_t lkey;
+    uint32_t rkey;
+};
+
+struct ibv_comp_channel {
+    struct ibv_context* context;
+    int fd;
+    int refcnt;
+};
+
+struct ibv_cq {
+    struct ibv_context* context;
+    struct ibv_comp_channel* channel;
+    void* cq_context;
+    uint32_t handle;
+    int cqe;
+    uint32_t comp_events_completed;
+};
+
+enum ibv_wc_status {
+    IBV_WC_SUCCESS,
+    IBV_WC_LOC_LEN_ERR,
+    IBV_WC_LOC_QP_OP_ERR,
+    IBV_WC_LOC_EEC_OP_ERR,
+    IBV_WC_LOC_PROT_ERR,
+    IBV_WC_WR_FLUSH_ERR,
+    IBV_WC_MW_BIND_ERR,
+    IBV_WC_BAD_RESP_ERR,
+    IBV_WC_LOC_ACCESS_ERR,
+    IBV_WC_REM_INV_REQ_ERR,
+    IBV_WC_REM_ACCESS_ERR,
+    IBV_WC_REM_OP_ERR,
+    IBV_WC_RETRY_EXC_ERR,
+    IBV_WC_RNR_RETRY_EXC_ERR,
+};
+
+enum ibv_wc_opcode {
+    IBV_WC_SEND,
+    IBV_WC_RDMA_WRITE,
+    IBV_WC_RDMA_READ,
+    IBV_WC_COMP_SWAP,
+    IBV_WC_FETCH_ADD,
+    IBV_WC_BIND_MW,
+    IBV_WC_RECV = 1 << 7,
+    IBV_WC_RECV_RDMA_WITH_IMM,
+};
+
+struct ibv_wc {
+    uint64_t wr_id;
+    enum ibv_wc_status status;
+    enum ibv_wc_opcode opcode;
+    uint32_t vendor_err;
+    uint32_t byte_len;
+    uint32_t imm_data;
+    uint32_t qp_num;
+    uint32_t src_qp;
+    unsigned int wc_flags;
+    uint16_t pkey_index;
+    uint16_t slid;
+    uint8_t sl;
+    uint8_t dlid_path_bits;
+};
+
+enum ibv_wr_opcode {
+    IBV_WR_RDMA_WRITE,
+    IBV_WR_RDMA_WRITE_WITH_IMM,
+    IBV_WR_SEND,
+    IBV_WR_SEND_WITH_IMM,
+    IBV_WR_RDMA_READ,
+    IBV_WR_ATOMIC_CMP_AND_SWP,
+    IBV_WR_ATOMIC_FETCH_AND_ADD,
+};
+
+enum ibv_send_flags {
+    IBV_SEND_FENCE = 1 << 0,
+    IBV_SEND_SIGNALED = 1 << 1,
+    IBV_SEND_SOLICITED = 1 << 2,
+    IBV_SEND_INLINE = 1 << 3,
+};
+
+struct ibv_sge {
+    uint64_t addr;
+    uint32_t length;
+    uint32_t lkey;
+};
+
+struct ibv_send_wr {
+    uint64_t wr_id;
+    struct ibv_send_wr* next;
+    struct ibv_sge* sg_list;
+    int num_sge;
+    enum ibv_wr_opcode opcode;
+    unsigned int send_flags;
+    uint32_t imm_data;
+};
+
+struct ibv_recv_wr {
+    uint64_t wr_id;
+    struct ibv_recv_wr* next;
+    struct ibv_sge* sg_list;
+    int num_sge;
+};
+
+enum ibv_qp_type {
+    IBV_QPT_RC = 2,
+    IBV_QPT_UC,
+    IBV_QPT_UD,
+};
+
+enum ibv_qp_state {
+    IBV_QPS_RESET,
+    IBV_QPS_INIT,
+    IBV_QPS_RTR,
+    IBV_QPS_RTS,
+    IBV_QPS_SQD,
+    IBV_QPS_SQE,
+    IBV_QPS_ERR,
+};
+
+struct ibv_srq;
+
+struct ibv_qp_cap {
+    uint32_t max_send_wr;
+    uint32_t max_recv_wr;
+    uint32_t max_send_sge;
+    uint32_t max_recv_sge;
+    uint32_t max_inline_data;
+};
+
+struct ibv_qp_init_attr {
+    void* qp_context;
+    struct ibv_cq* send_cq;
+    struct ibv_cq* recv_cq;
+    struct ibv_srq* srq;
+    struct ibv_qp_cap cap;
+    enum ibv_qp_type qp_type;
+    int sq_sig_all;
+};
+
+struct ibv_qp {
+    struct ibv_context* context;
+    void* qp_context;
+    struct ibv_pd* pd;
+    struct ibv_cq* send_cq;
+    struct ibv_cq* recv_cq;
+    struct ibv_srq* srq;
+    uint32_t handle;
+    uint32_t qp_num;
+    enum ibv_qp_state state;
+    enum ibv_qp_type qp_type;
+};
+
+struct ibv_device** ibv_get_device_list(int* num_devices);
+void ibv_free_device_list(struct ibv_device** list);
+struct ibv_context* ibv_open_device(struct ibv_device* device);
+int ibv_close_device(struct ibv_context* context);
+
+struct ibv_pd* ibv_alloc_pd(struct ibv_context* context);
+int ibv_dealloc_pd(struct ibv_pd* pd);
+
+struct ibv_mr* ibv_reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access);
+int ibv_dereg_mr(struct ibv_mr* mr);
+
+struct ibv_comp_channel* ibv_create_comp_channel(struct ibv_context* context);
+int ibv_destroy_comp_channel(struct ibv_comp_channel* channel);
+
+struct ibv_cq* ibv_create_cq(struct ibv_context* context, int cqe, void* cq_context,
+                             struct ibv_comp_channel* channel, int comp_vector);
+int ibv_destroy_cq(struct ibv_cq* cq);
+int ibv_get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context);
+void ibv_ack_cq_events(struct ibv_cq* cq, unsigned int nevents);
+int ibv_req_notify_cq(struct ibv_cq* cq, int solicited_only);
+int ibv_poll_cq(struct ibv_cq* cq, int num_entries, struct ibv_wc* wc);
+
+struct ibv_qp* ibv_create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr);
+int ibv_destroy_qp(struct ibv_qp* qp);
+int ibv_post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr);
+int ibv_post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+
+// ---------------------------------------------------------------- rdmacm
+
+enum rdma_cm_event_type {
+    RDMA_CM_EVENT_ADDR_RESOLVED,
+    RDMA_CM_EVENT_ADDR_ERROR,
+    RDMA_CM_EVENT_ROUTE_RESOLVED,
+    RDMA_CM_EVENT_ROUTE_ERROR,
+    RDMA_CM_EVENT_CONNECT_REQUEST,
+    RDMA_CM_EVENT_CONNECT_RESPONSE,
+    RDMA_CM_EVENT_CONNECT_ERROR,
+    RDMA_CM_EVENT_UNREACHABLE,
+    RDMA_CM_EVENT_REJECTED,
+    RDMA_CM_EVENT_ESTABLISHED,
+    RDMA_CM_EVENT_DISCONNECTED,
+    RDMA_CM_EVENT_DEVICE_REMOVAL,
+    RDMA_CM_EVENT_MULTICAST_JOIN,
+    RDMA_CM_EVENT_MULTICAST_ERROR,
+    RDMA_CM_EVENT_ADDR_CHANGE,
+    RDMA_CM_EVENT_TIMEWAIT_EXIT,
+};
+
+enum rdma_port_space {
+    RDMA_PS_IPOIB = 0x0002,
+    RDMA_PS_TCP = 0x0106,
+    RDMA_PS_UDP = 0x0111,
+    RDMA_PS_IB = 0x013F,
+};
+
+struct rdma_event_channel {
+    int fd;
+};
+
+struct rdma_addr {
+    union {
+        struct sockaddr src_addr;
+        struct sockaddr_in src_sin;
+        struct sockaddr_storage src_storage;
+    };
+    union {
+        struct sockaddr dst_addr;
+        struct sockaddr_in dst_sin;
+        struct sockaddr_storage dst_storage;
+    };
+};
+
+struct rdma_route {
+    struct rdma_addr addr;
+};
+
+struct rdma_cm_id {
+    struct ibv_context* verbs;
+    struct rdma_event_channel* channel;
+    void* context;
+    struct ibv_qp* qp;
+    struct rdma_route route;
+    enum rdma_port_space ps;
+    uint8_t port_num;
+    struct ibv_pd* pd;
+};
+
+struct rdma_conn_param {
+    const void* private_data;
+    uint8_t private_data_len;
+    uint8_t responder_resources;
+    uint8_t initiator_depth;
+    uint8_t flow_control;
+    uint8_t retry_count;
+    uint8_t rnr_retry_count;
+    uint8_t srq;
+    uint32_t qp_num;
+};
+
+struct rdma_cm_event {
+    struct rdma_cm_id* id;
+    struct rdma_cm_id* listen_id;
+    enum rdma_cm_event_type event;
+    int status;
+    union {
+        struct rdma_conn_param conn;
+    } param;
+};
+
+struct rdma_addrinfo {
+    int ai_flags;
+    int ai_family;
+    int ai_qp_type;
+    int ai_port_space;
+    socklen_t ai_src_len;
+    socklen_t ai_dst_len;
+    struct sockaddr* ai_src_addr;
+    struct sockaddr* ai_dst_addr;
+    char* ai_src_canonname;
+    char* ai_dst_canonname;
+    size_t ai_route_len;
+    void* ai_route;
+    size_t ai_connect_len;
+    void* ai_connect;
+    struct rdma_addrinfo* ai_next;
+};
+
+struct rdma_event_channel* rdma_create_event_channel(void);
+void rdma_destroy_event_channel(struct rdma_event_channel* channel);
+int rdma_get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event);
+int rdma_ack_cm_event(struct rdma_cm_event* event);
+
+int rdma_create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context,
+                   enum rdma_port_space ps);
+int rdma_destroy_id(struct rdma_cm_id* id);
+int rdma_bind_addr(struct rdma_cm_id* id, struct sockaddr* addr);
+int rdma_listen(struct rdma_cm_id* id, int backlog);
+int rdma_resolve_addr(struct rdma_cm_id* id, struct sockaddr* src_addr, struct sockaddr* dst_addr,
+                      int timeout_ms);
+int rdma_resolve_route(struct rdma_cm_id* id, int timeout_ms);
+int rdma_connect(struct rdma_cm_id* id, struct rdma_conn_param* conn_param);
+int rdma_accept(struct rdma_cm_id* id, struct rdma_conn_param* conn_param);
+int rdma_disconnect(struct rdma_cm_id* id);
+
+int rdma_create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr);
+void rdma_destroy_qp(struct rdma_cm_id* id);
+
+static inline struct sockaddr* rdma_get_local_addr(struct rdma_cm_id* id)
+{
+    return &id->route.addr.src_addr;
+}
+
+static inline struct sockaddr* rdma_get_peer_addr(struct rdma_cm_id* id)
+{
+    return &id->route.addr.dst_addr;
+}
+
+static inline uint16_t rdma_get_src_port(struct rdma_cm_id* id)
+{
+    return id->route.addr.src_sin.sin_port;
+}
+
+static inline uint16_t rdma_get_dst_port(struct rdma_cm_id* id)
+{
+    return id->route.addr.dst_sin.sin_port;
+}
+
+static inline int rdma_dereg_mr(struct ibv_mr* mr)
+{
+    return ibv_dereg_mr(mr);
+}
+
+#endif
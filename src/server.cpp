@@ -12,35 +12,6 @@
 
 #include "echo.h"
 
-//Yuanguo: 处理Work Completion通知。有两种类型：
-//  - IBV_WC_RECV：Receive Work Completion，即接收完成通知
-//      - 把接收到的数据打印出来；
-//      - 把接收到的数据拷贝到send_buf;
-//      - 发送(即post一个Send Work Request)
-//  - IBV_WC_SEND：Send Work Completion，即发送完成通知
-//      - 把已发送的数据打印出来；
-//      - 继续接收(即post一个Receive Work Request)，client可能继续发消息！
-static void on_recv_completion(struct ibv_wc* wc)
-{
-  if (wc->status != IBV_WC_SUCCESS) {
-    printf("Completion failed!");
-    return;
-  }
-
-  connection_t* conn = (connection_t*)(uintptr_t)wc->wr_id;
-  if (wc->opcode & IBV_WC_RECV) {
-    printf("[%lu] Received: %s\n", wc->wr_id, conn->recv_buf);
-    memcpy(conn->send_buf, conn->recv_buf, BUFFER_SIZE);
-    memset(conn->recv_buf, 0, BUFFER_SIZE);
-    post_send_work_request(conn);
-  } else if (wc->opcode == IBV_WC_SEND) {
-    printf("[%lu] Sent: %s.\n", wc->wr_id, conn->send_buf);
-    memset(conn->send_buf, 0, BUFFER_SIZE);
-    memset(conn->recv_buf, 0, BUFFER_SIZE);
-    post_recv_work_request(conn);
-  }
-}
-
 static int on_cm_connection_request(struct rdma_cm_id* id)
 {
   //Yuanguo: 见main函数中关于 rdma_get_cm_event(...) 的注释。
@@ -55,7 +26,7 @@ static int on_cm_connection_request(struct rdma_cm_id* id)
   // initialize app context if not initialized, build peer connection
   // create queue pair, register memory, initialize memory buffers,
   // and post initial receives
-  initialize_peer_connection(id, on_recv_completion);
+  initialize_peer_connection(id, on_echo_completion);
 
   // accept connection
   memset(&conn_param, 0, sizeof(struct rdma_conn_param));
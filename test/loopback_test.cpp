@@ -0,0 +1,396 @@
+// Behaviour of the loopback provider (src/loopback.h) that the benchmarks do not exercise: parked
+// sends, completion errors, flushing on disconnect, connection rejection, CQ notification and CQ
+// overrun.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "loopback.h"
+
+#define CHECK(x)                                                                     \
+    do {                                                                             \
+        if (!(x)) {                                                                  \
+            fprintf(stderr, "%s:%d: check failed: " #x "\n", __FILE__, __LINE__);    \
+            exit(EXIT_FAILURE);                                                      \
+        }                                                                            \
+    } while (0)
+
+#define BUF_SIZE 64
+
+typedef struct qp_pair {
+    struct rdma_event_channel* cm_channel;
+    struct rdma_cm_id* listener;
+    struct rdma_cm_id* client;
+    struct rdma_cm_id* server;
+    struct ibv_context* verbs;
+    struct ibv_pd* pd;
+    struct ibv_comp_channel* comp_channel;
+    struct ibv_cq* cq;
+    char send_buf[BUF_SIZE];
+    char recv_buf[BUF_SIZE];
+    struct ibv_mr* send_mr;
+    struct ibv_mr* recv_mr;
+} qp_pair_t;
+
+static struct rdma_cm_id* expect_cm_event(struct rdma_event_channel* channel, enum rdma_cm_event_type type,
+                                          int status = 0)
+{
+    struct rdma_cm_event* event = NULL;
+    CHECK(rdma_get_cm_event(channel, &event) == 0);
+    CHECK(event->event == type);
+    CHECK(event->status == status);
+    struct rdma_cm_id* id = event->id;
+    rdma_ack_cm_event(event);
+    return id;
+}
+
+static void create_qp(qp_pair_t* p, struct rdma_cm_id* id)
+{
+    struct ibv_qp_init_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.send_cq = attr.recv_cq = p->cq;
+    attr.qp_type = IBV_QPT_RC;
+    attr.cap.max_send_wr = attr.cap.max_recv_wr = 4;
+    attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+    CHECK(rdma_create_qp(id, p->pd, &attr) == 0);
+}
+
+static void resolve_client(qp_pair_t* p, uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = port;
+
+    CHECK(rdma_create_id(p->cm_channel, &p->client, NULL, RDMA_PS_IB) == 0);
+    CHECK(rdma_resolve_addr(p->client, NULL, (struct sockaddr*)&addr, 500) == 0);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ADDR_RESOLVED);
+    CHECK(p->client->verbs == p->verbs);
+    create_qp(p, p->client);
+    CHECK(rdma_resolve_route(p->client, 500) == 0);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ROUTE_RESOLVED);
+}
+
+static void open_pair(qp_pair_t* p, int cq_size)
+{
+    struct ibv_device** devices;
+    int num_devices = 0;
+
+    memset(p, 0, sizeof(*p));
+    CHECK((devices = ibv_get_device_list(&num_devices)) != NULL);
+    CHECK(num_devices == 1);
+    CHECK((p->verbs = ibv_open_device(devices[0])) != NULL);
+    ibv_free_device_list(devices);
+
+    CHECK((p->pd = ibv_alloc_pd(p->verbs)) != NULL);
+    CHECK((p->comp_channel = ibv_create_comp_channel(p->verbs)) != NULL);
+    CHECK((p->cq = ibv_create_cq(p->verbs, cq_size, NULL, p->comp_channel, 0)) != NULL);
+    CHECK((p->send_mr = ibv_reg_mr(p->pd, p->send_buf, BUF_SIZE, IBV_ACCESS_LOCAL_WRITE)) != NULL);
+    CHECK((p->recv_mr = ibv_reg_mr(p->pd, p->recv_buf, BUF_SIZE, IBV_ACCESS_LOCAL_WRITE)) != NULL);
+    CHECK((p->cm_channel = rdma_create_event_channel()) != NULL);
+}
+
+static void connect_pair(qp_pair_t* p, int cq_size = 16)
+{
+    struct sockaddr_in addr;
+    struct rdma_conn_param conn_param;
+
+    open_pair(p, cq_size);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(rdma_create_id(p->cm_channel, &p->listener, NULL, RDMA_PS_IB) == 0);
+    CHECK(rdma_bind_addr(p->listener, (struct sockaddr*)&addr) == 0);
+    CHECK(rdma_listen(p->listener, 10) == 0);
+
+    resolve_client(p, rdma_get_src_port(p->listener));
+
+    memset(&conn_param, 0, sizeof(conn_param));
+    CHECK(rdma_connect(p->client, &conn_param) == 0);
+    p->server = expect_cm_event(p->cm_channel, RDMA_CM_EVENT_CONNECT_REQUEST);
+    CHECK(p->server != p->listener);
+    create_qp(p, p->server);
+    CHECK(rdma_accept(p->server, &conn_param) == 0);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ESTABLISHED);
+    expect_cm_event(p->cm_channel, RDMA_CM_EVENT_ESTABLISHED);
+    CHECK(p->client->qp->state == IBV_QPS_RTS && p->server->qp->state == IBV_QPS_RTS);
+}
+
+static void close_pair(qp_pair_t* p)
+{
+    struct ibv_wc wc;
+    while (ibv_poll_cq(p->cq, 1, &wc) > 0) {
+    }
+
+    if (p->server != NULL) {
+        rdma_destroy_qp(p->server);
+        rdma_destroy_id(p->server);
+    }
+    if (p->listener != NULL) {
+        rdma_destroy_id(p->listener);
+    }
+    rdma_destroy_qp(p->client);
+    rdma_destroy_id(p->client);
+    rdma_destroy_event_channel(p->cm_channel);
+    ibv_dereg_mr(p->send_mr);
+    ibv_dereg_mr(p->recv_mr);
+    ibv_destroy_cq(p->cq);
+    ibv_destroy_comp_channel(p->comp_channel);
+    ibv_dealloc_pd(p->pd);
+    ibv_close_device(p->verbs);
+}
+
+static int post_send(struct ibv_qp* qp, void* addr, uint32_t length, uint32_t lkey, uint64_t wr_id)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)addr,
+        .length = length,
+        .lkey = lkey
+    };
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+static int post_recv(struct ibv_qp* qp, void* addr, uint32_t length, uint32_t lkey, uint64_t wr_id)
+{
+    struct ibv_recv_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)addr,
+        .length = length,
+        .lkey = lkey
+    };
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    return ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+// Poll one completion of the given opcode; the send and receive side share the CQ and their
+// relative order is not part of the contract.
+static struct ibv_wc poll_one(qp_pair_t* p, enum ibv_wc_opcode opcode, struct ibv_wc* other = NULL)
+{
+    struct ibv_wc wc[2];
+    if (other != NULL) {
+        CHECK(ibv_poll_cq(p->cq, 2, wc) == 2);
+        CHECK(wc[0].opcode != wc[1].opcode);
+        *other = wc[0].opcode == opcode ? wc[1] : wc[0];
+        return wc[0].opcode == opcode ? wc[0] : wc[1];
+    }
+    CHECK(ibv_poll_cq(p->cq, 1, wc) == 1);
+    CHECK(wc[0].opcode == opcode);
+    return wc[0];
+}
+
+static bool cq_empty(qp_pair_t* p)
+{
+    struct ibv_wc wc;
+    return ibv_poll_cq(p->cq, 1, &wc) == 0;
+}
+
+static void test_send_parks_until_recv()
+{
+    qp_pair_t p;
+    connect_pair(&p);
+
+    strcpy(p.send_buf, "hello");
+    CHECK(post_send(p.client->qp, p.send_buf, 6, p.send_mr->lkey, 1) == 0);
+    CHECK(cq_empty(&p));
+
+    CHECK(post_recv(p.server->qp, p.recv_buf, BUF_SIZE, p.recv_mr->lkey, 2) == 0);
+    struct ibv_wc send;
+    struct ibv_wc recv = poll_one(&p, IBV_WC_RECV, &send);
+    CHECK(recv.status == IBV_WC_SUCCESS && recv.wr_id == 2 && recv.byte_len == 6);
+    CHECK(recv.qp_num == p.server->qp->qp_num && recv.src_qp == p.client->qp->qp_num);
+    CHECK(strcmp(p.recv_buf, "hello") == 0);
+    CHECK(send.status == IBV_WC_SUCCESS && send.opcode == IBV_WC_SEND && send.wr_id == 1);
+    CHECK(cq_empty(&p));
+
+    close_pair(&p);
+}
+
+static void test_recv_too_small()
+{
+    qp_pair_t p;
+    connect_pair(&p);
+
+    CHECK(post_recv(p.server->qp, p.recv_buf, 4, p.recv_mr->lkey, 2) == 0);
+    CHECK(post_send(p.client->qp, p.send_buf, 16, p.send_mr->lkey, 1) == 0);
+    struct ibv_wc send;
+    struct ibv_wc recv = poll_one(&p, IBV_WC_RECV, &send);
+    CHECK(recv.status == IBV_WC_LOC_LEN_ERR && recv.wr_id == 2);
+    CHECK(send.status == IBV_WC_REM_INV_REQ_ERR && send.wr_id == 1);
+
+    close_pair(&p);
+}
+
+static void test_protection_errors()
+{
+    qp_pair_t p;
+    connect_pair(&p);
+
+    // An unknown lkey fails the send and leaves the receive posted.
+    CHECK(post_recv(p.server->qp, p.recv_buf, BUF_SIZE, p.recv_mr->lkey, 2) == 0);
+    CHECK(post_send(p.client->qp, p.send_buf, 8, 0xdead, 1) == 0);
+    struct ibv_wc wc = poll_one(&p, IBV_WC_SEND);
+    CHECK(wc.status == IBV_WC_LOC_PROT_ERR && wc.wr_id == 1);
+    CHECK(cq_empty(&p));
+
+    // So does a range outside of the memory region.
+    CHECK(post_send(p.client->qp, p.send_buf + 8, BUF_SIZE, p.send_mr->lkey, 3) == 0);
+    wc = poll_one(&p, IBV_WC_SEND);
+    CHECK(wc.status == IBV_WC_LOC_PROT_ERR && wc.wr_id == 3);
+
+    CHECK(post_send(p.client->qp, p.send_buf, 8, p.send_mr->lkey, 4) == 0);
+    struct ibv_wc send;
+    wc = poll_one(&p, IBV_WC_RECV, &send);
+    CHECK(wc.status == IBV_WC_SUCCESS && wc.wr_id == 2);
+    CHECK(send.status == IBV_WC_SUCCESS && send.wr_id == 4);
+
+    // A receive buffer without local write access fails on both sides.
+    struct ibv_mr* read_only;
+    CHECK((read_only = ibv_reg_mr(p.pd, p.recv_buf, BUF_SIZE, IBV_ACCESS_REMOTE_READ)) != NULL);
+    CHECK(post_recv(p.server->qp, p.recv_buf, BUF_SIZE, read_only->lkey, 5) == 0);
+    CHECK(post_send(p.client->qp, p.send_buf, 8, p.send_mr->lkey, 6) == 0);
+    wc = poll_one(&p, IBV_WC_RECV, &send);
+    CHECK(wc.status == IBV_WC_LOC_PROT_ERR && wc.wr_id == 5);
+    CHECK(send.status == IBV_WC_REM_OP_ERR && send.wr_id == 6);
+    ibv_dereg_mr(read_only);
+
+    close_pair(&p);
+}
+
+static void test_flush_on_disconnect()
+{
+    qp_pair_t p;
+    connect_pair(&p);
+
+    CHECK(post_recv(p.server->qp, p.recv_buf, BUF_SIZE, p.recv_mr->lkey, 1) == 0);
+    CHECK(post_recv(p.client->qp, p.recv_buf, BUF_SIZE, p.recv_mr->lkey, 2) == 0);
+
+    CHECK(rdma_disconnect(p.client) == 0);
+    struct rdma_cm_id* first = expect_cm_event(p.cm_channel, RDMA_CM_EVENT_DISCONNECTED);
+    struct rdma_cm_id* second = expect_cm_event(p.cm_channel, RDMA_CM_EVENT_DISCONNECTED);
+    CHECK((first == p.client && second == p.server) || (first == p.server && second == p.client));
+    CHECK(p.client->qp->state == IBV_QPS_ERR && p.server->qp->state == IBV_QPS_ERR);
+
+    struct ibv_wc wc[3];
+    CHECK(ibv_poll_cq(p.cq, 3, wc) == 2);
+    CHECK(wc[0].status == IBV_WC_WR_FLUSH_ERR && wc[1].status == IBV_WC_WR_FLUSH_ERR);
+    CHECK(wc[0].wr_id + wc[1].wr_id == 3);
+
+    // Receives posted after the disconnect are flushed right away, sends are refused.
+    CHECK(post_recv(p.server->qp, p.recv_buf, BUF_SIZE, p.recv_mr->lkey, 3) == 0);
+    CHECK(poll_one(&p, IBV_WC_RECV).status == IBV_WC_WR_FLUSH_ERR);
+    CHECK(post_send(p.client->qp, p.send_buf, 8, p.send_mr->lkey, 4) == EINVAL);
+    CHECK(rdma_disconnect(p.client) == -1 && errno == EINVAL);
+
+    close_pair(&p);
+}
+
+static void test_rejected_without_listener()
+{
+    qp_pair_t p;
+    struct rdma_conn_param conn_param;
+
+    open_pair(&p, 16);
+    resolve_client(&p, htons(1));
+    memset(&conn_param, 0, sizeof(conn_param));
+    CHECK(rdma_connect(p.client, &conn_param) == 0);
+    expect_cm_event(p.cm_channel, RDMA_CM_EVENT_REJECTED, ECONNREFUSED);
+    CHECK(post_send(p.client->qp, p.send_buf, 8, p.send_mr->lkey, 1) == EINVAL);
+
+    close_pair(&p);
+}
+
+static void send_message(qp_pair_t* p)
+{
+    CHECK(post_recv(p->server->qp, p->recv_buf, BUF_SIZE, p->recv_mr->lkey, 1) == 0);
+    CHECK(post_send(p->client->qp, p->send_buf, 8, p->send_mr->lkey, 2) == 0);
+}
+
+static void test_one_event_per_notification()
+{
+    qp_pair_t p;
+    struct ibv_cq* cq;
+    void* cq_context;
+    connect_pair(&p);
+
+    // Armed: however many completions arrive, the channel gets one event.
+    CHECK(ibv_req_notify_cq(p.cq, 0) == 0);
+    send_message(&p);
+    send_message(&p);
+    CHECK(ibv_get_cq_event(p.comp_channel, &cq, &cq_context) == 0);
+    CHECK(cq == p.cq);
+    ibv_ack_cq_events(cq, 1);
+    CHECK(p.cq->comp_events_completed == 1);
+
+    // Not re-armed: no event.
+    send_message(&p);
+    std::atomic<bool> got_event(false);
+    std::thread waiter([&] {
+        struct ibv_cq* cq;
+        void* cq_context;
+        CHECK(ibv_get_cq_event(p.comp_channel, &cq, &cq_context) == 0);
+        got_event = true;
+    });
+    usleep(50 * 1000);
+    CHECK(!got_event);
+
+    // Re-armed: the next completion wakes the waiter up.
+    CHECK(ibv_req_notify_cq(p.cq, 0) == 0);
+    send_message(&p);
+    waiter.join();
+    CHECK(got_event);
+
+    struct ibv_wc wc[16];
+    CHECK(ibv_poll_cq(p.cq, 16, wc) == 8);
+
+    close_pair(&p);
+}
+
+static void test_cq_overrun_aborts()
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        qp_pair_t p;
+        connect_pair(&p, 1);
+        // The receive and the send completion do not both fit.
+        send_message(&p);
+        _exit(0);
+    }
+
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int main()
+{
+    test_send_parks_until_recv();
+    test_recv_too_small();
+    test_protection_errors();
+    test_flush_on_disconnect();
+    test_rejected_without_listener();
+    test_one_event_per_notification();
+    test_cq_overrun_aborts();
+    printf("all loopback tests passed\n");
+    return 0;
+}